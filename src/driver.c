@@ -1,14 +1,137 @@
 #include "graphics.h"
 #include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/resource.h>
 
-int main() 
+// Draw the demo scene into a buffer
+void draw_scene(void *buffer)
+{
+    // Individual pixels somewhere on the top left
+    draw_pixel(buffer, 10, 10, RGB(31, 0, 0));   // red
+    draw_pixel(buffer, 12, 12, RGB(0, 63, 0));   // green
+    draw_pixel(buffer, 14, 14, RGB(0, 0, 31));   // blue
+
+    // red line somewhere on the top left quadrant
+    draw_line(buffer, 50, 50, 250, 150, RGB(31, 0, 0));
+
+    // Weird shaped triangl in green
+    fill_triangle(buffer, 100, 100, 120, 150, 60, 180, RGB(0, 63, 0));
+}
+
+// Wall time in milliseconds and minor page faults so far
+double now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1.0e6;
+}
+
+long minor_faults()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+// One line of bench results, the stats are the change over the phase
+void print_phase(const char *name, double ms, long faults, struct buffer_stats *before, struct buffer_stats *after)
+{
+    printf("%-6s %8.1f ms %8ld faults  %3lu mapped  %3lu reused  %6ld us mapping+prefault\n",
+           name, ms, faults, after->maps - before->maps, after->reuses - before->reuses,
+           after->map_usec - before->map_usec);
+}
+
+// ==========================================================================================
+// Bench mode: ./driver bench [scenes]
+// "fresh" makes a new buffer per scene and only frees them at the end, like callers did
+// before there was a free function. "pool" frees each one after the scene so it gets recycled.
+// ==========================================================================================
+int run_bench(int scenes)
+{
+    void *buffers[256];
+    if (scenes < 1) scenes = 1;
+    if (scenes > 256) scenes = 256;
+
+    struct buffer_stats start, middle, end;
+    int i;
+
+    get_buffer_stats(&start);
+    long faults0 = minor_faults();
+    double time0 = now_ms();
+
+    for (i = 0; i < scenes; i++)
+    {
+        buffers[i] = new_offscreen_buffer();
+        if (!buffers[i])
+        {
+            exit_graphics();
+            return 1;
+        }
+
+        clear_screen(buffers[i]);
+        draw_scene(buffers[i]);
+        blit(buffers[i]);
+    }
+
+    double time1 = now_ms();
+    long faults1 = minor_faults();
+    get_buffer_stats(&middle);
+
+    for (i = 0; i < scenes; i++) free_offscreen_buffer(buffers[i]);
+
+    long faults2 = minor_faults();
+    double time2 = now_ms();
+
+    for (i = 0; i < scenes; i++)
+    {
+        void *buffer = new_offscreen_buffer();
+        if (!buffer)
+        {
+            exit_graphics();
+            return 1;
+        }
+
+        clear_screen(buffer);
+        draw_scene(buffer);
+        blit(buffer);
+        free_offscreen_buffer(buffer);
+    }
+
+    double time3 = now_ms();
+    long faults3 = minor_faults();
+    get_buffer_stats(&end);
+
+    exit_graphics();
+
+    printf("%d scenes, %d x %d\n", scenes, render_width(), render_height());
+    print_phase("fresh", time1 - time0, faults1 - faults0, &start, &middle);
+    print_phase("pool", time3 - time2, faults3 - faults2, &middle, &end);
+    return 0;
+}
+
+int main(int argc, char *argv[])
 {
     // Init
     init_graphics();
 
+    // Bench mode instead of the demo
+    if (argc > 1 && argv[1][0] == 'b')
+    {
+        int scenes = 32;
+        if (argc > 2)
+        {
+            scenes = 0;
+            const char *digits = argv[2];
+            while (*digits >= '0' && *digits <= '9') scenes = scenes * 10 + (*digits++ - '0');
+        }
+
+        return run_bench(scenes);
+    }
+
     // Create a second offscreen buffer
     void *buffer = new_offscreen_buffer();
-    if (!buffer) 
+    if (!buffer)
     {
         exit_graphics();
         return 1;
@@ -17,31 +140,29 @@ int main()
     // Clear just in case
     clear_screen(buffer);
 
-    // Individual pixels somewhere on the top left
-    draw_pixel(buffer, 10, 10, RGB(31, 0, 0));   // red
-    draw_pixel(buffer, 12, 12, RGB(0, 63, 0));   // green
-    draw_pixel(buffer, 14, 14, RGB(0, 0, 31));   // blue 
-
-    // red line somewhere on the top left quadrant
-    draw_line(buffer, 50, 50, 250, 150, RGB(31, 0, 0));
-
-    // Weird shaped triangl in green
-    fill_triangle(buffer, 100, 100, 120, 150, 60, 180, RGB(0, 63, 0));
+    draw_scene(buffer);
 
     // Switch the buffers
     blit(buffer);
 
     // If not a null terminator (any key u can press), then terminate
     char key = '\0';
-    while (!key) 
+    while (!key)
     {
         key = getkey();
     }
-    
+
     // Cleanup
+    free_offscreen_buffer(buffer);
     exit_graphics();
 
+    // Terminal is back to normal now, show how the buffer pool did
+    struct buffer_stats stats;
+    get_buffer_stats(&stats);
+    printf("buffers: %lu mapped (%lu hugepage, %lu bytes, %ld us incl. prefault), %lu reused\n",
+           stats.maps, stats.hugepage_maps, stats.bytes_mapped, stats.map_usec, stats.reuses);
+
     // Will sleep for a bit before terminating
     sleep_ms(5000);
     return 0;
-}
\ No newline at end of file
+}
@@ -13,6 +13,32 @@ typedef unsigned short color_t;
 // Some bit masking and shifitng for the RGB
 #define RGB(r, g, b) (((r & 0x1F) << 11) | ((g & 0x3F) << 5) | (b & 0x1F))
 
+// Upscale filters for set_render_scale
+#define SCALE_NEAREST 0
+#define SCALE_BILINEAR 1
+
+// Offscreen buffer pool counters, map_usec includes prefaulting the pages
+struct buffer_stats
+{
+    unsigned long maps;
+    unsigned long hugepage_maps;
+    unsigned long reuses;
+    unsigned long releases;
+    unsigned long unmaps;
+    unsigned long bytes_mapped;
+    long map_usec;
+};
+
+// Recorder counters, frames_captured counts every blit while recording
+struct recorder_stats
+{
+    unsigned long frames_captured;
+    unsigned long frames_dropped;
+    unsigned long frames_written;
+    unsigned long bytes_written;
+    int write_failed;
+};
+
 // Graphics functions
 void init_graphics();
 void exit_graphics();
@@ -23,4 +49,21 @@ void draw_pixel(void *img, int x, int y, color_t color);
 void draw_line(void *img, int x1, int y1, int x2, int y2, color_t c);
 void fill_triangle(void *img, int x1, int y1, int x2, int y2, int x3, int y3, color_t c);
 void *new_offscreen_buffer();
-void blit(void *src);
\ No newline at end of file
+void free_offscreen_buffer(void *buffer);
+void release_buffer_pool();
+void get_buffer_stats(struct buffer_stats *stats);
+void set_render_scale(int scale, int filter);
+int render_width();
+int render_height();
+void blit(void *src);
+
+// Recorder functions
+int start_recording(const char *path, int compress);
+void stop_recording();
+void wait_recording();
+int is_recording();
+void record_frame(const void *frame);
+void get_recorder_stats(struct recorder_stats *stats);
+int open_recording(const char *path);
+int read_recorded_frame(int fd, void *img, long long *usec);
+void close_recording(int fd);
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <time.h>
 #include <linux/fb.h>
 
 #include "graphics.h"
@@ -21,9 +22,68 @@ fd_set fdescriptor;
 struct fb_var_screeninfo vinfo;
 struct fb_fix_screeninfo finfo;
 struct termios tcinfo;
-struct timeval time;
+struct timeval key_timeout;
 struct timespec sleep_time;
 
+// Offscreen buffer pool, buffers get recycled instead of mapped again
+#define BUFFER_POOL_SIZE 4
+#define OVERFLOW_START_SIZE 16
+#define DEFAULT_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+// Upscale factors past this are refused, it bounds the bilinear weight table
+#define MAX_RENDER_SCALE 16
+
+struct pool_slot
+{
+    void* ptr;
+    size_t size;
+    size_t mapped_size;
+    int in_use;
+    int huge;
+};
+
+struct pool_slot buffer_pool[BUFFER_POOL_SIZE];
+
+// Buffers handed out once the pool is full, kept so they get unmapped with the size they were made with.
+// The table doubles whenever it fills up, so callers that never free still get every buffer they ask for
+struct pool_slot* overflow_buffers = NULL;
+size_t overflow_size = 0;
+
+// Default hugepage size from /proc/meminfo, read the first time a buffer gets mapped
+size_t hugepage_size = 0;
+struct buffer_stats buffer_stats;
+
+// Offscreen buffer geometry in pixels, smaller than the screen when rendering scaled
+int render_scale = 1;
+int render_filter = SCALE_NEAREST;
+unsigned int buffer_width;
+unsigned int buffer_height;
+unsigned int buffer_stride;
+
+// Recompute the offscreen buffer geometry for the current scale
+static void update_render_geometry()
+{
+    if (render_scale == 1)
+    {
+        // Full resolution buffers match the framebuffer byte for byte
+        buffer_width = finfo.line_length / sizeof(color_t);
+        buffer_height = vinfo.yres_virtual;
+        buffer_stride = buffer_width;
+        return;
+    }
+
+    // Scaled buffers only cover the visible screen, rows padded to a 64 byte cache line
+    buffer_width = vinfo.xres / render_scale;
+    buffer_height = vinfo.yres / render_scale;
+    buffer_stride = (buffer_width + 31) & ~31u;
+}
+
+// Size in bytes of one offscreen buffer
+static size_t buffer_size()
+{
+    return (size_t)buffer_stride * buffer_height * sizeof(color_t);
+}
+
 void init_graphics()
 {
     // Open the fb0 file
@@ -68,8 +128,10 @@ void init_graphics()
     tcinfo.c_lflag &= ~ECHO;
     ioctl(STDIN_FILENO, TCSETS, &tcinfo);
 
-    time.tv_sec = 0;
-    time.tv_usec = 0;
+    key_timeout.tv_sec = 0;
+    key_timeout.tv_usec = 0;
+
+    update_render_geometry();
 
     return;
 }
@@ -81,6 +143,13 @@ void exit_graphics()
     tcinfo.c_lflag |= ECHO;
     ioctl(STDIN_FILENO, TCSETS, &tcinfo);
 
+    // Flush and close any recording still going
+    stop_recording();
+    wait_recording();
+
+    // Give back all the offscreen buffers
+    release_buffer_pool();
+
     // unmap the mapped buffer
     if (munmap(fb_ptr, screensize) == -1)
     {
@@ -100,7 +169,7 @@ char getkey()
     char key_pressed = '\0';
 
     // Monitor the fds, with the nfds + 1 according to the documentation (which is weird)
-    int ret = select(STDIN_FILENO + 1, &fdescriptor, NULL, NULL, &time);
+    int ret = select(STDIN_FILENO + 1, &fdescriptor, NULL, NULL, &key_timeout);
 
     // Check for the input
     if (ret > 0) 
@@ -140,7 +209,7 @@ void clear_screen(void *img)
     char* destination = (char*)img;
 
     int i;
-    for (i = 0; i < vinfo.yres_virtual * finfo.line_length; i++)
+    for (i = 0; i < buffer_size(); i++)
     {
         destination[i] = 0;
     }
@@ -149,7 +218,7 @@ void clear_screen(void *img)
 void draw_pixel(void *img, int x, int y, color_t color) 
 {
     // Check the inputs are valid
-    if (img == NULL || x < 0 || y < 0 || x >= finfo.line_length / 2 || y >= vinfo.yres_virtual)
+    if (img == NULL || x < 0 || y < 0 || x >= buffer_width || y >= buffer_height)
     {
         // TODO: Log error
         return;
@@ -160,10 +229,10 @@ void draw_pixel(void *img, int x, int y, color_t color)
 
     // ===================================================================================================
     // Now we need to calculate the offset for the row_major order buffer.
-    // We can do this by multiplying the y by line_length so we will be in the correct line width buffer
+    // We can do this by multiplying the y by the stride so we will be in the correct line width buffer
     // Then need to find the correct pixel in that line buffer and we can just do it by adding the x
     // ===================================================================================================
-    unsigned int pixel_offset = ((finfo.line_length / 2) * y) + x;
+    unsigned int pixel_offset = (buffer_stride * y) + x;
 
     img_new[pixel_offset] = color; 
 }
@@ -173,9 +242,9 @@ void draw_line(void *img, int x1, int y1, int x2, int y2, color_t c)
     // Got the algorithm from https://www.baeldung.com/cs/bresenhams-line-algorithm
     // Check the inputs are valid
     if (img == NULL || x1 < 0 || y1 < 0 || 
-        x1 >= finfo.line_length / 2 || y1 >= vinfo.yres_virtual || 
+        x1 >= buffer_width || y1 >= buffer_height || 
         x2 < 0 || y2 < 0 || 
-        x2 >= finfo.line_length / 2 || y2 >= vinfo.yres_virtual)
+        x2 >= buffer_width || y2 >= buffer_height)
     {
         // TODO: Log error
         return;
@@ -232,11 +301,11 @@ void fill_triangle(void *img, int x1, int y1, int x2, int y2, int x3, int y3, co
     // Check the inputs are valid
     if (img == NULL || 
         x1 < 0 || y1 < 0 || 
-        x1 >= finfo.line_length / sizeof(color_t) || y1 >= vinfo.yres_virtual || 
+        x1 >= buffer_width || y1 >= buffer_height || 
         x2 < 0 || y2 < 0 || 
-        x2 >= finfo.line_length / sizeof(color_t) || y2 >= vinfo.yres_virtual ||
+        x2 >= buffer_width || y2 >= buffer_height ||
         x3 < 0 || y3 < 0 || 
-        x3 >= finfo.line_length / sizeof(color_t) || y3 >= vinfo.yres_virtual)
+        x3 >= buffer_width || y3 >= buffer_height)
     {
         // Log error
         return;
@@ -323,24 +392,495 @@ void fill_triangle(void *img, int x1, int y1, int x2, int y2, int x3, int y3, co
     }
 }
 
-void *new_offscreen_buffer() 
+// Touch one byte per page so the first frame drawn doesn't pay the page faults
+static void prefault_buffer(void* buffer, size_t size)
 {
-    // Multiply the screen height with line length
-    screensize = vinfo.yres_virtual * finfo.line_length;
-    
-    // Map the contents of the file to a memory
-    void* second_fb = mmap(0, screensize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    volatile char* bytes = (volatile char*)buffer;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    size_t i;
+    for (i = 0; i < size; i += page)
+    {
+        bytes[i] = 0;
+    }
+}
+
+// Read the default hugepage size out of /proc/meminfo, falling back to 2 MiB
+static size_t get_hugepage_size()
+{
+    if (hugepage_size != 0)
+    {
+        return hugepage_size;
+    }
+
+    hugepage_size = DEFAULT_HUGEPAGE_SIZE;
+
+    int meminfo = open("/proc/meminfo", O_RDONLY);
+    if (meminfo == -1)
+    {
+        // Log the error
+        return hugepage_size;
+    }
+
+    char text[4096];
+    ssize_t length = read(meminfo, text, sizeof(text) - 1);
+    close(meminfo);
+
+    if (length <= 0)
+    {
+        // Log the error
+        return hugepage_size;
+    }
+    text[length] = '\0';
+
+    // Looking for a line like "Hugepagesize:       2048 kB"
+    const char* key = "Hugepagesize:";
+    ssize_t i;
+    for (i = 0; i < length; i++)
+    {
+        int k = 0;
+        while (key[k] != '\0' && text[i + k] == key[k]) k++;
+        if (key[k] != '\0') continue;
+
+        i += k;
+        while (text[i] == ' ') i++;
+
+        size_t kb = 0;
+        while (text[i] >= '0' && text[i] <= '9') kb = kb * 10 + (text[i++] - '0');
+
+        if (kb != 0) hugepage_size = kb * 1024;
+        break;
+    }
+
+    return hugepage_size;
+}
+
+// Microseconds on the monotonic clock, so setting the wall clock can't skew the stats
+static long monotonic_usec()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+// Map a fresh buffer, hugepages first if allowed, then a regular mapping with THP as a hint
+static void* map_buffer(size_t size, int allow_huge, size_t* mapped_size, int* huge)
+{
+    long start = monotonic_usec();
+
+    // Hugepage mappings need their length rounded up to the hugepage size
+    size_t page = get_hugepage_size();
+    size_t huge_size = (size + page - 1) & ~(page - 1);
+    void* buffer = (void*)-1;
+    if (allow_huge)
+    {
+        buffer = mmap(0, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+
+    if (buffer != (void*)-1)
+    {
+        *mapped_size = huge_size;
+        *huge = 1;
+    }
+    else
+    {
+        // ==========================================================================================
+        // No hugepages reserved, so fall back to normal pages. THP can only back whole aligned
+        // hugepages, so map one extra, then trim the ends so the buffer starts on a hugepage
+        // boundary and covers whole hugepages.
+        // ==========================================================================================
+        char* base = (char*)mmap(0, huge_size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        // mmap returns (void*)-1 on fail
+        if ((void*)base == (void*)-1)
+        {
+            // Log the error
+            return NULL;
+        }
+
+        char* aligned = (char*)(((size_t)base + page - 1) & ~(page - 1));
+        if (aligned > base) munmap(base, aligned - base);
+        if (aligned + huge_size < base + huge_size + page)
+        {
+            munmap(aligned + huge_size, (base + huge_size + page) - (aligned + huge_size));
+        }
+        buffer = aligned;
+
+        // Ask for transparent hugepages, it's fine if the kernel says no
+        madvise(buffer, huge_size, MADV_HUGEPAGE);
+
+        *mapped_size = huge_size;
+        *huge = 0;
+    }
+
+    prefault_buffer(buffer, *mapped_size);
+
+    buffer_stats.maps++;
+    if (*huge) buffer_stats.hugepage_maps++;
+    buffer_stats.bytes_mapped += *mapped_size;
+    buffer_stats.map_usec += monotonic_usec() - start;
+
+    return buffer;
+}
+
+// Double the overflow table, copying the old entries over
+static int grow_overflow()
+{
+    size_t new_size = overflow_size == 0 ? OVERFLOW_START_SIZE : overflow_size * 2;
+    struct pool_slot* table = (struct pool_slot*)mmap(0, new_size * sizeof(struct pool_slot),
+                                                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
     // mmap returns (void*)-1 on fail
-    if (second_fb == (void*)-1)
+    if ((void*)table == (void*)-1)
     {
         // Log the error
+        return -1;
+    }
+
+    // Fresh anonymous memory is zeroed, so the new entries start out empty
+    size_t i;
+    for (i = 0; i < overflow_size; i++) table[i] = overflow_buffers[i];
+
+    if (overflow_buffers != NULL) munmap(overflow_buffers, overflow_size * sizeof(struct pool_slot));
+
+    overflow_buffers = table;
+    overflow_size = new_size;
+    return 0;
+}
+
+void *new_offscreen_buffer() 
+{
+    // Buffer size follows the render scale, full resolution is the same as the framebuffer
+    size_t size = buffer_size();
+
+    // First try to recycle a released buffer of the same size
+    int i;
+    for (i = 0; i < BUFFER_POOL_SIZE; i++)
+    {
+        if (buffer_pool[i].ptr != NULL && !buffer_pool[i].in_use && buffer_pool[i].size == size)
+        {
+            // Fresh mappings come back zeroed, so recycled ones have to as well
+            unsigned int* words = (unsigned int*)buffer_pool[i].ptr;
+            size_t w;
+            for (w = 0; w < size / sizeof(unsigned int); w++) words[w] = 0;
+            if (size & 2) ((color_t*)buffer_pool[i].ptr)[size / sizeof(color_t) - 1] = 0;
+
+            buffer_pool[i].in_use = 1;
+            buffer_stats.reuses++;
+            return buffer_pool[i].ptr;
+        }
+    }
+
+    // Otherwise map a new one into an empty slot, or else one holding a released buffer
+    // of some other size, which is left over from before a set_render_scale()
+    int slot = -1;
+    for (i = 0; i < BUFFER_POOL_SIZE && slot == -1; i++)
+    {
+        if (buffer_pool[i].ptr == NULL) slot = i;
+    }
+    for (i = 0; i < BUFFER_POOL_SIZE && slot == -1; i++)
+    {
+        if (!buffer_pool[i].in_use && buffer_pool[i].size != size)
+        {
+            munmap(buffer_pool[i].ptr, buffer_pool[i].mapped_size);
+            buffer_stats.unmaps++;
+            buffer_pool[i].ptr = NULL;
+            slot = i;
+        }
+    }
+
+    if (slot != -1)
+    {
+        void* second_fb = map_buffer(size, 1, &buffer_pool[slot].mapped_size, &buffer_pool[slot].huge);
+        if (second_fb == NULL)
+        {
+            return NULL;
+        }
+
+        buffer_pool[slot].ptr = second_fb;
+        buffer_pool[slot].size = size;
+        buffer_pool[slot].in_use = 1;
+        return second_fb;
+    }
+
+    // Pool is full of live buffers, hand out an unpooled one on normal pages
+    size_t o;
+    for (o = 0; o < overflow_size; o++)
+    {
+        if (overflow_buffers[o].ptr == NULL) break;
+    }
+
+    // Every overflow entry is taken, make room for more
+    if (o == overflow_size && grow_overflow() == -1)
+    {
         return NULL;
     }
 
+    void* second_fb = map_buffer(size, 0, &overflow_buffers[o].mapped_size, &overflow_buffers[o].huge);
+    if (second_fb == NULL)
+    {
+        return NULL;
+    }
+
+    overflow_buffers[o].ptr = second_fb;
+    overflow_buffers[o].size = size;
+    overflow_buffers[o].in_use = 1;
     return second_fb;
 }
 
+void free_offscreen_buffer(void *buffer)
+{
+    if (buffer == NULL)
+    {
+        // Log error
+        return;
+    }
+
+    // Pooled buffers stay mapped so the next new_offscreen_buffer() can reuse them
+    int i;
+    for (i = 0; i < BUFFER_POOL_SIZE; i++)
+    {
+        if (buffer_pool[i].ptr == buffer)
+        {
+            buffer_pool[i].in_use = 0;
+            buffer_stats.releases++;
+            return;
+        }
+    }
+
+    // Unpooled buffers go straight back to the kernel
+    size_t o;
+    for (o = 0; o < overflow_size; o++)
+    {
+        if (overflow_buffers[o].ptr == buffer)
+        {
+            if (munmap(buffer, overflow_buffers[o].mapped_size) == -1)
+            {
+                // Log the error
+                return;
+            }
+            buffer_stats.unmaps++;
+
+            overflow_buffers[o].ptr = NULL;
+            overflow_buffers[o].size = 0;
+            overflow_buffers[o].mapped_size = 0;
+            overflow_buffers[o].in_use = 0;
+            return;
+        }
+    }
+
+    // Log error, not one of ours
+}
+
+void release_buffer_pool()
+{
+    // Unmap every buffer, pooled or not and live or not, since the screen is going away
+    int i;
+    for (i = 0; i < BUFFER_POOL_SIZE; i++)
+    {
+        if (buffer_pool[i].ptr != NULL)
+        {
+            munmap(buffer_pool[i].ptr, buffer_pool[i].mapped_size);
+            buffer_stats.unmaps++;
+
+            buffer_pool[i].ptr = NULL;
+            buffer_pool[i].size = 0;
+            buffer_pool[i].mapped_size = 0;
+            buffer_pool[i].in_use = 0;
+            buffer_pool[i].huge = 0;
+        }
+    }
+
+    size_t o;
+    for (o = 0; o < overflow_size; o++)
+    {
+        if (overflow_buffers[o].ptr != NULL)
+        {
+            munmap(overflow_buffers[o].ptr, overflow_buffers[o].mapped_size);
+            buffer_stats.unmaps++;
+        }
+    }
+
+    // And the table itself
+    if (overflow_buffers != NULL)
+    {
+        munmap(overflow_buffers, overflow_size * sizeof(struct pool_slot));
+        overflow_buffers = NULL;
+        overflow_size = 0;
+    }
+}
+
+void get_buffer_stats(struct buffer_stats *stats)
+{
+    if (stats == NULL)
+    {
+        // Log error
+        return;
+    }
+
+    *stats = buffer_stats;
+}
+
+void set_render_scale(int scale, int filter)
+{
+    // The recorder sized its frames for the current geometry, so it can't change under it
+    if (is_recording())
+    {
+        // Log error
+        return;
+    }
+
+    if (scale < 1 || scale > MAX_RENDER_SCALE || vinfo.xres / scale == 0 || vinfo.yres / scale == 0 ||
+        (filter != SCALE_NEAREST && filter != SCALE_BILINEAR))
+    {
+        // Log error
+        return;
+    }
+
+    // Buffers made before this keep their old size, so make new ones after calling it
+    render_scale = scale;
+    render_filter = filter;
+    update_render_geometry();
+}
+
+int render_width()
+{
+    return render_scale == 1 ? vinfo.xres : buffer_width;
+}
+
+int render_height()
+{
+    return render_scale == 1 ? vinfo.yres : buffer_height;
+}
+
+// ==========================================================================================
+// Spread an RGB565 pixel out to 0x07E0F81F so each channel has room above it,
+// then a 5 bit weight can blend all three channels with one multiply each
+// ==========================================================================================
+static unsigned int spread_565(color_t c)
+{
+    return (c | ((unsigned int)c << 16)) & 0x07E0F81F;
+}
+
+static color_t pack_565(unsigned int c)
+{
+    c &= 0x07E0F81F;
+    return (color_t)(c | (c >> 16));
+}
+
+// Blend two spread pixels, w goes from 0 (all a) to 32 (all b)
+static unsigned int lerp_565(unsigned int a, unsigned int b, unsigned int w)
+{
+    return ((a * (32 - w) + b * w) >> 5) & 0x07E0F81F;
+}
+
+// Nearest neighbour upscale straight into the framebuffer
+static void blit_nearest(color_t* source)
+{
+    color_t* destination = fb_ptr;
+    unsigned int fb_stride = finfo.line_length / sizeof(color_t);
+    unsigned int scale = render_scale;
+
+    unsigned int y;
+    for (y = 0; y < vinfo.yres; y++)
+    {
+        // Leftover rows at the bottom repeat the last source row
+        unsigned int src_y = y / scale;
+        if (src_y >= buffer_height) src_y = buffer_height - 1;
+
+        color_t* src_row = source + src_y * buffer_stride;
+        color_t* dst_row = destination + y * fb_stride;
+        unsigned int x = 0;
+
+        unsigned int src_x;
+        if (scale == 2 && (finfo.line_length & 3) == 0)
+        {
+            // 2x is the common case, write both copies of a pixel as one 32 bit store
+            unsigned int* dst_pair = (unsigned int*)dst_row;
+            for (src_x = 0; src_x < buffer_width; src_x++)
+            {
+                dst_pair[src_x] = src_row[src_x] | ((unsigned int)src_row[src_x] << 16);
+            }
+            x = buffer_width * 2;
+        }
+        else
+        {
+            for (src_x = 0; src_x < buffer_width; src_x++)
+            {
+                color_t c = src_row[src_x];
+
+                unsigned int k;
+                for (k = 0; k < scale; k++) dst_row[x++] = c;
+            }
+        }
+
+        // Leftover columns on the right repeat the last source pixel
+        for (; x < vinfo.xres; x++) dst_row[x] = src_row[buffer_width - 1];
+    }
+}
+
+// Bilinear upscale straight into the framebuffer, with 5 bit weights
+static void blit_bilinear(color_t* source)
+{
+    color_t* destination = fb_ptr;
+    unsigned int fb_stride = finfo.line_length / sizeof(color_t);
+    unsigned int scale = render_scale;
+
+    // Weights only depend on the position inside a scale x scale block, so work them out once
+    unsigned int weights[MAX_RENDER_SCALE];
+    unsigned int k;
+    for (k = 0; k < scale; k++) weights[k] = k * 32 / scale;
+
+    // Step the source row along instead of dividing every row
+    unsigned int src_y = 0;
+    unsigned int sub_y = 0;
+
+    unsigned int y;
+    for (y = 0; y < vinfo.yres; y++)
+    {
+        // Pick the two source rows and how far between them this row sits
+        unsigned int row_y = src_y;
+        unsigned int wy = weights[sub_y];
+        if (++sub_y == scale)
+        {
+            sub_y = 0;
+            src_y++;
+        }
+
+        if (row_y >= buffer_height - 1)
+        {
+            row_y = buffer_height - 1;
+            wy = 0;
+        }
+        unsigned int next_y = (row_y + 1 < buffer_height) ? row_y + 1 : row_y;
+
+        color_t* top = source + row_y * buffer_stride;
+        color_t* bottom = source + next_y * buffer_stride;
+        color_t* dst_row = destination + y * fb_stride;
+        unsigned int x = 0;
+
+        // Blend the rows vertically once per source pixel, then horizontally per output pixel
+        unsigned int left = lerp_565(spread_565(top[0]), spread_565(bottom[0]), wy);
+
+        unsigned int src_x;
+        for (src_x = 0; src_x < buffer_width; src_x++)
+        {
+            unsigned int next_x = (src_x + 1 < buffer_width) ? src_x + 1 : src_x;
+            unsigned int right = lerp_565(spread_565(top[next_x]), spread_565(bottom[next_x]), wy);
+
+            for (k = 0; k < scale; k++)
+            {
+                dst_row[x++] = pack_565(lerp_565(left, right, weights[k]));
+            }
+
+            left = right;
+        }
+
+        // Leftover columns on the right repeat the last blended pixel
+        for (; x < vinfo.xres; x++) dst_row[x] = pack_565(left);
+    }
+}
+
 void blit(void *src) 
 {
     if (src == NULL)
@@ -349,12 +889,23 @@ void blit(void *src)
         return;
     }
 
+    // Hand the finished frame to the recorder first, it never waits on the disk
+    record_frame(src);
+
+    // Scaled buffers get upscaled on the way to the framebuffer, no extra pass needed
+    if (render_scale > 1)
+    {
+        if (render_filter == SCALE_BILINEAR) blit_bilinear((color_t*)src);
+        else blit_nearest((color_t*)src);
+        return;
+    }
+
     // For good sake cast everything to char to ensure byte by byte copying
     char* destination = (char*)fb_ptr;
     char* source = (char*)src;
 
     int i;
-    for(i = 0; i < vinfo.yres_virtual * finfo.line_length; i++)
+    for(i = 0; i < buffer_size(); i++)
     {
         destination[i] = source[i];
     }
@@ -8,12 +8,12 @@
 #include <time.h>
 // For sin and cos
 #include <math.h>
+// For the stats printed on exit
+#include <stdio.h>
 
-// Define the map and screensize
+// Define the map size
 #define mapWidth 24
 #define mapHeight 24
-#define screenWidth 640
-#define screenHeight 480
 
 // Our map. 0 is walkable; i > 0 is not
 int worldMap[mapWidth][mapHeight]=
@@ -65,7 +65,9 @@ color_t darken(color_t color)
     return RGB(r, g, b);
 }
 
-int main()
+// Usage: ./myprogram [scale] [b]
+// scale renders at 1/scale resolution and upscales on blit, b picks bilinear over nearest
+int main(int argc, char *argv[])
 {
     // Position of the player
     double posX = 22, posY = 12;
@@ -80,6 +82,17 @@ int main()
     // Initialize the framebuffer
     init_graphics();
 
+    // Pick the render scale before making any buffers
+    int scale = 1;
+    int filter = SCALE_NEAREST;
+    if (argc > 1 && argv[1][0] >= '1' && argv[1][0] <= '9') scale = argv[1][0] - '0';
+    if (argc > 2 && argv[2][0] == 'b') filter = SCALE_BILINEAR;
+    set_render_scale(scale, filter);
+
+    // Screen size comes from the framebuffer now, divided down by the scale
+    int screenWidth = render_width();
+    int screenHeight = render_height();
+
     // Create a second offscreen buffer
     void *buffer = new_offscreen_buffer();
     if (!buffer) 
@@ -93,6 +106,9 @@ int main()
     
     double w = screenWidth;
 
+    // Toggled with R
+    int recording = 0;
+
     // Start the timer
     clock_gettime(CLOCK_MONOTONIC, &start);
 
@@ -118,7 +134,7 @@ int main()
         for (x = 0; x < w; x ++)
         {
             // Calculate ray position and direction
-            // Normalizes each point along the camera axis between [-1, 1] from [0, 640]
+            // Normalizes each point along the camera axis between [-1, 1] from [0, screenWidth]
             double cameraX = (2 * x) / w - 1;  
 
             // RayDirx will stay constant initially until the direction moves
@@ -279,11 +295,43 @@ int main()
             planeX = planeX * cos(rotSpeed) - planeY * sin(rotSpeed);
             planeY = oldPlaneX * sin(rotSpeed) + planeY * cos(rotSpeed);
         }
+        // Start or stop recording to raycast.rec, play it back with ./replay raycast.rec
+        if (keypressed == 'r')
+        {
+            if (recording)
+            {
+                stop_recording();
+                recording = 0;
+            }
+            else if (start_recording("raycast.rec", 1) == 0)
+            {
+                recording = 1;
+            }
+        }
         // Break out of main loop
         if (keypressed == 'q') 
         {
+            free_offscreen_buffer(buffer);
             exit_graphics();
             break;
         }
     }
+
+    // Terminal is back to normal now, show how the buffer pool did
+    struct buffer_stats stats;
+    get_buffer_stats(&stats);
+    printf("buffers: %lu mapped (%lu hugepage, %lu bytes, %ld us incl. prefault), %lu reused\n",
+           stats.maps, stats.hugepage_maps, stats.bytes_mapped, stats.map_usec, stats.reuses);
+
+    // And how the last recording went, if there was one
+    struct recorder_stats rec;
+    get_recorder_stats(&rec);
+    if (rec.frames_captured > 0)
+    {
+        printf("recording: %lu frames captured, %lu written, %lu dropped, %lu bytes%s\n",
+               rec.frames_captured, rec.frames_written, rec.frames_dropped, rec.bytes_written,
+               rec.write_failed ? ", write failed" : "");
+    }
+
+    return 0;
 }
\ No newline at end of file
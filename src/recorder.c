@@ -0,0 +1,652 @@
+// recorder.c
+
+// Frame recorder, blit() hands frames over through a lock-free ring and a
+// background thread does all the compressing and file writing
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <linux/fb.h>
+
+#include "graphics.h"
+
+// Frames that can wait for the writer before blit() starts dropping them
+#define RECORD_RING_SIZE 8
+#define RECORD_MAGIC 0x43524246 // "FBRC"
+#define RECORD_VERSION 1
+
+// Per frame payload encodings
+#define FRAME_RAW 0
+#define FRAME_DELTA_RLE 1
+
+// Buffer geometry from library.c
+extern struct fb_var_screeninfo vinfo;
+extern int render_scale;
+extern int render_filter;
+extern unsigned int buffer_stride;
+
+// File header, written once at the start
+struct record_header
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int width;
+    unsigned int height;
+    unsigned int scale;
+    unsigned int filter;
+    unsigned int screen_width;
+    unsigned int screen_height;
+};
+
+// Written in front of every frame payload
+struct record_frame_header
+{
+    unsigned int sequence;
+    unsigned int encoding;
+    unsigned int payload_bytes;
+    unsigned int reserved;
+    long long usec;
+};
+
+// ==========================================================================================
+// Single producer single consumer ring. blit() is the only one moving head and the
+// writer thread is the only one moving tail, so neither side ever has to take a lock.
+// A slot is only touched by the side that owns it according to head and tail.
+// ==========================================================================================
+int record_fd = -1;
+pthread_t record_thread;
+atomic_int recording = 0;
+char record_path[256];
+
+// ==========================================================================================
+// The writer thread opens the file and maps the ring itself so blit() never waits on that.
+// writer_ready says the ring can take frames, writer_running stays set until the thread
+// has closed the file, and writer_joinable means nobody has joined the thread yet.
+// ==========================================================================================
+atomic_int writer_ready = 0;
+atomic_int writer_running = 0;
+int writer_joinable = 0;
+atomic_uint ring_head = 0;
+atomic_uint ring_tail = 0;
+long long ring_usec[RECORD_RING_SIZE];
+unsigned int ring_sequence[RECORD_RING_SIZE];
+color_t* ring_frames = NULL;
+color_t* previous_frame = NULL;
+unsigned short* encode_buffer = NULL;
+unsigned short* decode_buffer = NULL;
+size_t decode_buffer_size;
+void* record_memory = NULL;
+size_t record_memory_size;
+color_t* replay_frame = NULL;
+unsigned int record_width;
+unsigned int record_height;
+size_t frame_pixels;
+unsigned int replay_width;
+unsigned int replay_height;
+size_t replay_pixels;
+int record_compress;
+unsigned int next_sequence;
+struct timespec record_start;
+
+// Writer side counters live in atomics since the render thread reads them
+unsigned long frames_captured;
+unsigned long frames_dropped;
+atomic_ulong frames_written = 0;
+atomic_ulong bytes_written = 0;
+atomic_int write_failed = 0;
+
+// Keep writing until everything is out, write() can return short
+static int write_all(int fd, const void* data, size_t size)
+{
+    const char* bytes = (const char*)data;
+
+    while (size > 0)
+    {
+        ssize_t ret = write(fd, bytes, size);
+        if (ret <= 0)
+        {
+            return -1;
+        }
+
+        bytes += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+// Keep reading until the whole thing is in, 0 on a clean end of file
+static int read_all(int fd, void* data, size_t size)
+{
+    char* bytes = (char*)data;
+    size_t total = 0;
+
+    while (total < size)
+    {
+        ssize_t ret = read(fd, bytes + total, size - total);
+        if (ret < 0)
+        {
+            return -1;
+        }
+        if (ret == 0)
+        {
+            // Ending in the middle of something means the file is cut off
+            return total == 0 ? 0 : -1;
+        }
+
+        total += ret;
+    }
+
+    return 1;
+}
+
+// ==========================================================================================
+// XOR the frame against the previous one so unchanged pixels turn into zeros, then
+// run length encode that as (count, value) pairs. Returns the payload size in bytes.
+// ==========================================================================================
+static size_t encode_delta_rle(const color_t* frame, const color_t* previous, unsigned short* out)
+{
+    size_t pairs = 0;
+    size_t i = 0;
+
+    while (i < frame_pixels)
+    {
+        color_t value = frame[i] ^ previous[i];
+        unsigned int run = 1;
+
+        while (i + run < frame_pixels && run < 0xFFFF && (color_t)(frame[i + run] ^ previous[i + run]) == value)
+        {
+            run++;
+        }
+
+        out[pairs * 2] = (unsigned short)run;
+        out[pairs * 2 + 1] = value;
+        pairs++;
+        i += run;
+    }
+
+    return pairs * 2 * sizeof(unsigned short);
+}
+
+// Compress and write one frame from the ring, the writer owns the slot until tail moves
+static void write_frame(unsigned int slot)
+{
+    color_t* frame = ring_frames + slot * frame_pixels;
+    size_t raw_bytes = frame_pixels * sizeof(color_t);
+
+    struct record_frame_header header;
+    header.sequence = ring_sequence[slot];
+    header.usec = ring_usec[slot];
+    header.reserved = 0;
+
+    // Fall back to raw whenever the delta doesn't actually come out smaller
+    const void* payload = frame;
+    header.encoding = FRAME_RAW;
+    header.payload_bytes = raw_bytes;
+
+    if (record_compress)
+    {
+        size_t encoded = encode_delta_rle(frame, previous_frame, encode_buffer);
+        if (encoded < raw_bytes)
+        {
+            payload = encode_buffer;
+            header.encoding = FRAME_DELTA_RLE;
+            header.payload_bytes = encoded;
+        }
+    }
+
+    if (!atomic_load(&write_failed))
+    {
+        if (write_all(record_fd, &header, sizeof(header)) == -1 ||
+            write_all(record_fd, payload, header.payload_bytes) == -1)
+        {
+            // Log the error, keep draining the ring so blit() never backs up
+            atomic_store(&write_failed, 1);
+        }
+        else
+        {
+            atomic_fetch_add(&frames_written, 1);
+            atomic_fetch_add(&bytes_written, sizeof(header) + header.payload_bytes);
+        }
+    }
+
+    // The next delta is against this frame
+    size_t i;
+    for (i = 0; i < frame_pixels; i++) previous_frame[i] = frame[i];
+}
+
+// Map the ring, open the file and write the header, all on the writer thread
+static int open_writer()
+{
+    size_t frame_bytes = frame_pixels * sizeof(color_t);
+
+    // One mapping for the ring, the previous frame and the worst case RLE output
+    record_memory_size = frame_bytes * (RECORD_RING_SIZE + 1) + frame_pixels * 2 * sizeof(unsigned short);
+    record_memory = mmap(0, record_memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+    // mmap returns (void*)-1 on fail
+    if (record_memory == (void*)-1)
+    {
+        // Log the error
+        record_memory = NULL;
+        return -1;
+    }
+
+    ring_frames = (color_t*)record_memory;
+    previous_frame = ring_frames + RECORD_RING_SIZE * frame_pixels;
+    encode_buffer = (unsigned short*)(previous_frame + frame_pixels);
+
+    record_fd = open(record_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (record_fd == -1)
+    {
+        // Log the error
+        return -1;
+    }
+
+    struct record_header header;
+    header.magic = RECORD_MAGIC;
+    header.version = RECORD_VERSION;
+    header.width = record_width;
+    header.height = record_height;
+    header.scale = render_scale;
+    header.filter = render_filter;
+    header.screen_width = vinfo.xres;
+    header.screen_height = vinfo.yres;
+
+    if (write_all(record_fd, &header, sizeof(header)) == -1)
+    {
+        // Log the error
+        return -1;
+    }
+
+    atomic_fetch_add(&bytes_written, sizeof(header));
+    return 0;
+}
+
+// Close the file and give back the ring, also on the writer thread
+static void close_writer()
+{
+    if (record_fd != -1)
+    {
+        close(record_fd);
+        record_fd = -1;
+    }
+
+    if (record_memory != NULL)
+    {
+        munmap(record_memory, record_memory_size);
+        record_memory = NULL;
+    }
+
+    ring_frames = NULL;
+    previous_frame = NULL;
+    encode_buffer = NULL;
+}
+
+// Background thread, sleeps a little whenever the ring is empty
+static void* writer_loop(void* arg)
+{
+    (void)arg;
+
+    // If the file can't be set up the ring never opens, so blit() just counts every frame as dropped
+    if (open_writer() == -1)
+    {
+        atomic_store(&write_failed, 1);
+        close_writer();
+        atomic_store(&writer_running, 0);
+        return NULL;
+    }
+
+    // Let blit() start queueing frames
+    atomic_store_explicit(&writer_ready, 1, memory_order_release);
+
+    struct timespec idle;
+    idle.tv_sec = 0;
+    idle.tv_nsec = 2000000;
+
+    while (1)
+    {
+        unsigned int tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+        unsigned int head = atomic_load_explicit(&ring_head, memory_order_acquire);
+
+        if (tail == head)
+        {
+            // ==========================================================================
+            // Only quit once blit() has stopped and everything queued is written. A frame
+            // can be published between reading head and seeing recording drop, so look
+            // at head again before leaving.
+            // ==========================================================================
+            if (!atomic_load(&recording))
+            {
+                if (atomic_load_explicit(&ring_head, memory_order_acquire) == tail) break;
+                continue;
+            }
+
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        write_frame(tail % RECORD_RING_SIZE);
+
+        // Hand the slot back to blit()
+        atomic_store_explicit(&ring_tail, tail + 1, memory_order_release);
+    }
+
+    atomic_store(&writer_ready, 0);
+    close_writer();
+    atomic_store(&writer_running, 0);
+    return NULL;
+}
+
+int is_recording()
+{
+    return atomic_load(&recording);
+}
+
+int start_recording(const char *path, int compress)
+{
+    if (path == NULL || atomic_load(&recording))
+    {
+        // Log error
+        return -1;
+    }
+
+    // The last writer may still be draining, refuse rather than wait for it
+    if (writer_joinable)
+    {
+        if (atomic_load(&writer_running))
+        {
+            return -1;
+        }
+
+        // It has already finished, so this returns straight away
+        pthread_join(record_thread, NULL);
+        writer_joinable = 0;
+    }
+
+    // The writer opens the file, so hang on to a copy of the path
+    size_t length = 0;
+    while (path[length] != '\0') length++;
+    if (length >= sizeof(record_path))
+    {
+        // Log error
+        return -1;
+    }
+
+    size_t i;
+    for (i = 0; i <= length; i++) record_path[i] = path[i];
+
+    // Only the visible part gets recorded, not the row padding or virtual rows
+    record_width = render_width();
+    record_height = render_height();
+    frame_pixels = (size_t)record_width * record_height;
+
+    // Reset everything before the writer thread can see any of it
+    record_compress = compress;
+    next_sequence = 0;
+    frames_captured = 0;
+    frames_dropped = 0;
+    atomic_store(&frames_written, 0);
+    atomic_store(&bytes_written, 0);
+    atomic_store(&write_failed, 0);
+    atomic_store(&ring_head, 0);
+    atomic_store(&ring_tail, 0);
+    atomic_store(&writer_ready, 0);
+    clock_gettime(CLOCK_MONOTONIC, &record_start);
+
+    atomic_store(&writer_running, 1);
+    atomic_store(&recording, 1);
+    if (pthread_create(&record_thread, NULL, writer_loop, NULL) != 0)
+    {
+        // Log the error
+        atomic_store(&recording, 0);
+        atomic_store(&writer_running, 0);
+        return -1;
+    }
+    writer_joinable = 1;
+
+    return 0;
+}
+
+void stop_recording()
+{
+    // The writer drains whatever is still queued and closes the file on its own time
+    atomic_store(&recording, 0);
+}
+
+void wait_recording()
+{
+    // Blocks until the writer has drained and closed the file
+    if (writer_joinable)
+    {
+        pthread_join(record_thread, NULL);
+        writer_joinable = 0;
+    }
+}
+
+void record_frame(const void *frame)
+{
+    if (frame == NULL || !atomic_load_explicit(&recording, memory_order_relaxed))
+    {
+        return;
+    }
+
+    // Every blit gets a sequence number, so gaps in the file show where frames were dropped
+    unsigned int sequence = next_sequence++;
+    frames_captured++;
+
+    // Writer is still opening the file, or couldn't
+    if (!atomic_load_explicit(&writer_ready, memory_order_acquire))
+    {
+        frames_dropped++;
+        return;
+    }
+
+    unsigned int head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+
+    // Ring is full, drop the frame instead of waiting on the disk
+    if (head - tail >= RECORD_RING_SIZE)
+    {
+        frames_dropped++;
+        return;
+    }
+
+    unsigned int slot = head % RECORD_RING_SIZE;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ring_usec[slot] = (now.tv_sec - record_start.tv_sec) * 1000000LL + (now.tv_nsec - record_start.tv_nsec) / 1000;
+    ring_sequence[slot] = sequence;
+
+    // Pack the visible rows together, leaving the stride padding behind
+    const color_t* source = (const color_t*)frame;
+    color_t* destination = ring_frames + slot * frame_pixels;
+
+    unsigned int y;
+    for (y = 0; y < record_height; y++)
+    {
+        const color_t* src_row = source + (size_t)y * buffer_stride;
+        color_t* dst_row = destination + (size_t)y * record_width;
+
+        unsigned int x;
+        for (x = 0; x < record_width; x++) dst_row[x] = src_row[x];
+    }
+
+    // Publish the slot to the writer
+    atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+}
+
+void get_recorder_stats(struct recorder_stats *stats)
+{
+    if (stats == NULL)
+    {
+        // Log error
+        return;
+    }
+
+    stats->frames_captured = frames_captured;
+    stats->frames_dropped = frames_dropped;
+    stats->frames_written = atomic_load(&frames_written);
+    stats->bytes_written = atomic_load(&bytes_written);
+    stats->write_failed = atomic_load(&write_failed);
+}
+
+int open_recording(const char *path)
+{
+    if (path == NULL)
+    {
+        // Log error
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        // Log the error
+        return -1;
+    }
+
+    struct record_header header;
+    if (read_all(fd, &header, sizeof(header)) != 1 ||
+        header.magic != RECORD_MAGIC || header.version != RECORD_VERSION)
+    {
+        // Log error, not a recording
+        close(fd);
+        return -1;
+    }
+
+    // Render at the recorded scale so blit() upscales the frames the same way
+    set_render_scale(header.scale, header.filter);
+
+    // Frames cover the visible screen, so it has to be the same size here
+    if (header.screen_width != vinfo.xres || header.screen_height != vinfo.yres ||
+        header.width != render_width() || header.height != render_height())
+    {
+        // Log error, recorded on a different screen mode
+        close(fd);
+        return -1;
+    }
+
+    replay_width = header.width;
+    replay_height = header.height;
+    replay_pixels = (size_t)replay_width * replay_height;
+
+    // Room for the current frame plus the biggest payload a frame can have, a run per pixel
+    decode_buffer_size = replay_pixels * sizeof(color_t) + replay_pixels * 2 * sizeof(unsigned short);
+    decode_buffer = (unsigned short*)mmap(0, decode_buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    // mmap returns (void*)-1 on fail
+    if ((void*)decode_buffer == (void*)-1)
+    {
+        // Log the error
+        decode_buffer = NULL;
+        close(fd);
+        return -1;
+    }
+
+    // Deltas are against the previous frame, and the first one against black
+    replay_frame = (color_t*)(decode_buffer + replay_pixels * 2);
+
+    return fd;
+}
+
+void close_recording(int fd)
+{
+    if (decode_buffer != NULL)
+    {
+        munmap(decode_buffer, decode_buffer_size);
+        decode_buffer = NULL;
+        replay_frame = NULL;
+    }
+
+    close(fd);
+}
+
+int read_recorded_frame(int fd, void *img, long long *usec)
+{
+    if (img == NULL || decode_buffer == NULL)
+    {
+        // Log error
+        return -1;
+    }
+
+    struct record_frame_header header;
+    int ret = read_all(fd, &header, sizeof(header));
+    if (ret != 1)
+    {
+        return ret;
+    }
+
+    size_t raw_bytes = replay_pixels * sizeof(color_t);
+
+    if (header.encoding == FRAME_RAW)
+    {
+        if (header.payload_bytes != raw_bytes)
+        {
+            // Log error
+            return -1;
+        }
+
+        if (read_all(fd, replay_frame, raw_bytes) != 1) return -1;
+    }
+    else if (header.encoding == FRAME_DELTA_RLE)
+    {
+        if (header.payload_bytes > replay_pixels * 2 * sizeof(unsigned short) ||
+            header.payload_bytes % (2 * sizeof(unsigned short)) != 0)
+        {
+            // Log error
+            return -1;
+        }
+
+        if (read_all(fd, decode_buffer, header.payload_bytes) != 1) return -1;
+
+        // XOR the runs onto the previous frame
+        size_t pairs = header.payload_bytes / (2 * sizeof(unsigned short));
+        size_t i = 0;
+        size_t p;
+        for (p = 0; p < pairs; p++)
+        {
+            unsigned short run = decode_buffer[p * 2];
+            color_t value = decode_buffer[p * 2 + 1];
+
+            if (i + run > replay_pixels)
+            {
+                // Log error, run goes past the end of the frame
+                return -1;
+            }
+
+            unsigned int k;
+            for (k = 0; k < run; k++) replay_frame[i++] ^= value;
+        }
+
+        if (i != replay_pixels)
+        {
+            // Log error, runs don't cover the whole frame
+            return -1;
+        }
+    }
+    else
+    {
+        // Log error, unknown encoding
+        return -1;
+    }
+
+    // Spread the packed rows back out to the buffer's stride
+    color_t* pixels = (color_t*)img;
+
+    unsigned int y;
+    for (y = 0; y < replay_height; y++)
+    {
+        const color_t* src_row = replay_frame + (size_t)y * replay_width;
+        color_t* dst_row = pixels + (size_t)y * buffer_stride;
+
+        unsigned int x;
+        for (x = 0; x < replay_width; x++) dst_row[x] = src_row[x];
+    }
+
+    if (usec != NULL) *usec = header.usec;
+    return 1;
+}
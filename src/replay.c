@@ -0,0 +1,77 @@
+// replay.c
+
+// Plays a recording back through the same offscreen buffer + blit() path it was captured from
+#include "graphics.h"
+
+// For the playback clock
+#include <time.h>
+
+// Microseconds on the monotonic clock
+long long now_usec()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        return 1;
+    }
+
+    // Init
+    init_graphics();
+
+    // Opening the recording also switches to the scale it was recorded at
+    int fd = open_recording(argv[1]);
+    if (fd == -1)
+    {
+        exit_graphics();
+        return 1;
+    }
+
+    // Create a second offscreen buffer, after the scale is set
+    void *buffer = new_offscreen_buffer();
+    if (!buffer)
+    {
+        close_recording(fd);
+        exit_graphics();
+        return 1;
+    }
+
+    // Frames only cover the visible area, so clear whatever is outside it
+    clear_screen(buffer);
+
+    long long usec = 0;
+    long long start = 0;
+    int first = 1;
+
+    while (read_recorded_frame(fd, buffer, &usec) == 1)
+    {
+        // ==========================================================================================
+        // Frame times are relative to the start of playback, so decoding and blitting don't add up
+        // frame after frame. If playback is already late, show the frame straight away.
+        // ==========================================================================================
+        if (first)
+        {
+            start = now_usec() - usec;
+            first = 0;
+        }
+
+        long long wait = start + usec - now_usec();
+        if (wait > 0) sleep_ms((long)(wait / 1000));
+
+        blit(buffer);
+
+        // Q to stop early
+        if (getkey() == 'q') break;
+    }
+
+    // Cleanup
+    close_recording(fd);
+    free_offscreen_buffer(buffer);
+    exit_graphics();
+    return 0;
+}